@@ -0,0 +1,252 @@
+#include "camera.hpp"
+
+#include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <folly/Format.h>
+
+#include "utils.hpp"
+
+const int Camera::QUEUE_SIZE = 2;
+const int Camera::PICTURES = 3;
+
+bool is_camera_index(const std::string& source) {
+    if (source.empty()) {
+        return false;
+    }
+    for (auto c : source) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Camera::Camera(const std::string& source, int index, int run_id,
+               const cv::Rect2d& placement)
+: is_file_(!is_camera_index(source))
+, index_(index)
+, run_id_(run_id)
+, placement_(placement)
+, to_fusion_(QUEUE_SIZE) {
+    if (is_file_) {
+        capture_.open(source);
+    } else {
+        capture_.open(std::stoi(source));
+    }
+    if (!capture_.isOpened()) {
+        throw std::runtime_error("Could not open capture source " + source);
+    }
+    width_ = capture_.get(cv::CAP_PROP_FRAME_WIDTH);
+    height_ = capture_.get(cv::CAP_PROP_FRAME_HEIGHT);
+    if (width_ <= 0 || height_ <= 0) {
+        throw std::runtime_error(
+            "Capture source " + source + " does not report its frame size");
+    }
+    double fps = capture_.get(cv::CAP_PROP_FPS);
+    frame_duration_ = (is_file_ && fps > 0) ? 1 / fps : 0;
+    if (placement_.area() <= 0) {
+        // Side by side, keeping the aspect ratio so units are square.
+        placement_ = cv::Rect2d(index_, 0, 1, static_cast<double>(height_) / width_);
+    }
+    dbg("Capture", index_, source, width_, height_, fps);
+    camera_thread_ = std::thread([this](){
+        do_camera_thread();
+    });
+}
+
+Camera::~Camera() {
+    stop_ = true;
+    camera_thread_.join();
+}
+
+bool Camera::grab(cv::Mat& color) {
+    capture_ >> color;
+    if (color.empty() && is_file_) {
+        capture_.set(cv::CAP_PROP_POS_FRAMES, 0);
+        capture_ >> color;
+    }
+    return !color.empty();
+}
+
+void Camera::do_camera_thread() {
+    auto picture_delay = std::chrono::milliseconds(200);
+    auto frame_delay = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(frame_duration_));
+    auto begin = std::chrono::steady_clock::now();
+    auto next_frame = std::chrono::steady_clock::now();
+    int take_picture = 0;
+    int reference = 0;
+    dbg("Camera thread starting", index_);
+    while(!stop_) {
+        cv::Mat color, gray, flipped, blurred, thresh;
+        if (is_file_) {
+            std::this_thread::sleep_until(next_frame);
+            next_frame += frame_delay;
+        }
+        if (!grab(color)) {
+            std::cerr << "Camera " << index_ << " failed to grab a frame, stopping it" << std::endl;
+            break;
+        }
+
+        int requested = picture_reference_.exchange(-1);
+        if (requested >= 0) {
+            take_picture = PICTURES;
+            begin = std::chrono::steady_clock::now();
+            reference = requested;
+        }
+        if (take_picture &&
+                std::chrono::steady_clock::now() > (begin + picture_delay)) {
+            auto filename = folly::sformat(
+                "out/{}_{}_{:01d}_{:02d}.jpg", run_id_, index_, reference, take_picture);
+            cv::imwrite(filename, color);
+            --take_picture;
+            begin += picture_delay;
+        }
+
+        cv::cvtColor(color, gray, cv::COLOR_BGR2GRAY);
+        cv::flip(gray, flipped, 1);
+        cv::GaussianBlur(flipped, blurred, cv::Size(15, 15), 0);
+        cv::threshold(blurred, thresh, 100, 255, cv::THRESH_BINARY);
+
+        Detection detection;
+        detection.songs.resize(NUM_MARKERS);
+        find_songs(thresh, &detection.songs, &detection.drawing);
+        for (auto& song : detection.songs) {
+            song.center.x = placement_.x + song.center.x * placement_.width;
+            song.center.y = placement_.y + song.center.y * placement_.height;
+        }
+        if (!to_fusion_.write(std::move(detection))) {
+            dbg("Fusion too slow, dropping frame", index_);
+        }
+    }
+    done_ = true;
+    dbg("Camera thread done", index_);
+}
+
+bool Camera::read(Detection& detection) {
+    bool got_one = false;
+    // Only the latest frame matters.
+    while (to_fusion_.read(detection)) {
+        got_one = true;
+    }
+    return got_one;
+}
+
+bool Camera::done() const {
+    return done_;
+}
+
+void Camera::take_pictures(int reference) {
+    picture_reference_ = reference;
+}
+
+int Camera::index() const {
+    return index_;
+}
+
+int Camera::width() const {
+    return width_;
+}
+
+int Camera::height() const {
+    return height_;
+}
+
+const cv::Rect2d& Camera::placement() const {
+    return placement_;
+}
+
+void parse_source(const std::string& arg, std::string* source, cv::Rect2d* placement) {
+    assert(source);
+    assert(placement);
+    *source = arg;
+    *placement = cv::Rect2d();
+    auto at = arg.rfind('@');
+    if (at == std::string::npos) {
+        return;
+    }
+    // Anything else than 4 numbers is part of the source, file names may
+    // contain an @.
+    std::string spec = arg.substr(at + 1);
+    double x, y, width, height;
+    int consumed = 0;
+    if (std::sscanf(spec.c_str(), "%lf,%lf,%lf,%lf%n",
+                    &x, &y, &width, &height, &consumed) != 4 ||
+            consumed != static_cast<int>(spec.size())) {
+        return;
+    }
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error("Invalid placement " + spec + ", width and height must be positive");
+    }
+    *source = arg.substr(0, at);
+    *placement = cv::Rect2d(x, y, width, height);
+}
+
+void fuse_songs(
+        const std::vector<std::vector<QRSong>>& per_camera,
+        const std::vector<cv::Rect2d>& placements,
+        const cv::Rect2d& surface,
+        std::vector<QRSong>* fused,
+        std::vector<int>* best_camera) {
+    assert(fused);
+    assert(best_camera);
+    int count = per_camera.size();
+    assert(placements.size() == per_camera.size());
+    fused->assign(NUM_MARKERS, QRSong());
+    best_camera->assign(NUM_MARKERS, -1);
+    for (int i=0; i < NUM_MARKERS; ++i) {
+        // Start from the most confident detection of that song.
+        int best = -1;
+        for (int camera=0; camera < count; ++camera) {
+            const auto& songs = per_camera[camera];
+            if (i >= static_cast<int>(songs.size()) || !songs[i].active) {
+                continue;
+            }
+            if (best < 0 || songs[i].confidence > per_camera[best][i].confidence) {
+                best = camera;
+            }
+        }
+        if (best < 0) {
+            continue;
+        }
+        const auto& reference = per_camera[best][i];
+        cv::Point2d center(0, 0);
+        double size = 0;
+        double total = 0;
+        for (int camera=0; camera < count; ++camera) {
+            const auto& songs = per_camera[camera];
+            if (i >= static_cast<int>(songs.size()) || !songs[i].active) {
+                continue;
+            }
+            const auto& song = songs[i];
+            // Sizes are relative to each camera view, compare them in
+            // surface units.
+            double distance = cv::norm(song.center - reference.center);
+            double extent = std::max(song.size * placements[camera].width,
+                                     reference.size * placements[best].width);
+            if (distance > extent) {
+                // Another marker with the same id, only keep one.
+                continue;
+            }
+            // Keep a little weight for shapes that fit badly.
+            double weight = song.confidence + 1e-3;
+            center += weight * song.center;
+            size += weight * song.size;
+            total += weight;
+        }
+        auto& song = (*fused)[i];
+        song = reference;
+        song.center.x = (center.x / total - surface.x) / surface.width;
+        song.center.y = (center.y / total - surface.y) / surface.height;
+        song.size = size / total;
+        (*best_camera)[i] = best;
+    }
+}
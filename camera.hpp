@@ -0,0 +1,84 @@
+#ifndef _CAMERA_HPP_
+#define _CAMERA_HPP_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <folly/ProducerConsumerQueue.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+#include "qmix.hpp"
+
+struct Detection {
+    std::vector<QRSong> songs;
+    cv::Mat drawing;
+};
+
+// Capture source with its own decoding thread. `source` is either a camera
+// index or the path to a video file, which is looped and played at its
+// own frame rate so it can stand in for a camera.
+// `placement` is the area of the surface seen by the camera, in surface
+// units where a camera is one unit wide by default. Detection centers are
+// handed over in those units, sizes stay relative to the camera view.
+// An empty placement puts the camera at x = index.
+class Camera {
+public:
+    Camera(const std::string& source, int index, int run_id,
+           const cv::Rect2d& placement=cv::Rect2d());
+    virtual ~Camera();
+    bool read(Detection& detection);
+    // True once the capture failed and the thread stopped.
+    bool done() const;
+    void take_pictures(int reference);
+    int index() const;
+    int width() const;
+    int height() const;
+    const cv::Rect2d& placement() const;
+
+private:
+    void do_camera_thread();
+    bool grab(cv::Mat& color);
+
+    cv::VideoCapture capture_;
+    bool is_file_;
+    int index_;
+    int run_id_;
+    int width_;
+    int height_;
+    double frame_duration_;
+    cv::Rect2d placement_;
+    folly::ProducerConsumerQueue<Detection> to_fusion_;
+    std::thread camera_thread_;
+
+    std::atomic<int> picture_reference_{-1};
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> done_{false};
+
+    static const int QUEUE_SIZE;
+    static const int PICTURES;
+};
+
+// Split a command line argument `source[@x,y,width,height]` into the
+// capture source and its placement, left empty when the argument does not
+// end with 4 numbers after an @.
+void parse_source(const std::string& arg, std::string* source, cv::Rect2d* placement);
+
+// Merge the latest detections of every camera, centered in surface units,
+// into one state per song. Detections of a song closer than its size, scaled
+// to the surface by the camera `placements`, are the same marker seen by
+// overlapping cameras and are averaged, weighted by their confidence, around
+// the most confident one. Centers are then normalized to `surface`, sizes
+// stay relative to a camera view as the mixer expects. `best_camera`
+// receives the most confident camera per song.
+void fuse_songs(
+    const std::vector<std::vector<QRSong>>& per_camera,
+    const std::vector<cv::Rect2d>& placements,
+    const cv::Rect2d& surface,
+    std::vector<QRSong>* fused,
+    std::vector<int>* best_camera);
+
+#endif
@@ -10,8 +10,13 @@ BLACK = (0, 0, 0)
 WHITE = (1, 1, 1)
 
 class Context:
+    """
+    Draw shapes nested around the center of the image, each one inside the
+    circle inscribed in the previous one, `width` away from it.
+    """
     def __init__(self, size, width):
         self.center = [size / 2, size / 2]
+        # Diameter of the circle the next shape must fit in.
         self.size = size
         self.width = width
         self.surface = cairo.ImageSurface(cairo.FORMAT_RGB24, size, size)
@@ -19,71 +24,58 @@ class Context:
         self.context.set_source_rgb(*WHITE)
         self.context.paint()
 
-        self.last_rec = True
+        self.last_sides = None
+        self.last_radius = None
         self.last_black = False
 
-    def triangle(self):
-        if self.last_rec:
-            side = self.size - 2 * self.width * 0.7
-            height = math.sqrt(3) * side / 2
-            delta = (self.size - height) / 2
-            center = [self.center[0], self.center[1] - self.size / 2 + delta + height / 3]
-        else:
-            center = self.center
-            side = self.size - 2 * self.width
-            height = math.sqrt(3) * side / 2
+    def shape(self, sides):
+        """
+        Draw a regular polygon with `sides` sides, or a circle for 0.
+        """
+        radius = self.size / 2 - self.width
+        if sides and sides == self.last_sides:
+            # Same polygon, its sides can run along the previous ones.
+            radius = max(radius, self.last_radius - self.width / math.cos(math.pi / sides))
 
-        up = (center[0], center[1] + 2 * height / 3)
-        down_left = (center[0] - side / 2  , center[1] - height / 3)
-        down_right = (center[0] + side / 2  , center[1] - height / 3)
-
-        self.last_rec = False
         if self.last_black:
             self.context.set_source_rgb(*WHITE)
         else:
             self.context.set_source_rgb(*BLACK)
         self.last_black = not self.last_black
 
-        self.context.move_to(*up)
-        self.context.line_to(*down_right)
-        self.context.line_to(*down_left)
-        self.context.close_path()
+        if sides:
+            # Pointing up, or with a flat top for an even number of sides.
+            start = -math.pi / 2 + (math.pi / sides if sides % 2 == 0 else 0)
+            for k in range(sides):
+                angle = start + 2 * math.pi * k / sides
+                point = (self.center[0] + radius * math.cos(angle),
+                         self.center[1] + radius * math.sin(angle))
+                if k == 0:
+                    self.context.move_to(*point)
+                else:
+                    self.context.line_to(*point)
+            self.context.close_path()
+            inner_radius = radius * math.cos(math.pi / sides)
+        else:
+            self.context.arc(self.center[0], self.center[1], radius, 0, 2 * math.pi)
+            inner_radius = radius
         self.context.fill()
 
-        self.center = center
-        self.size = height
+        self.last_sides = sides
+        self.last_radius = radius
+        self.size = 2 * inner_radius
 
     def rectangle(self):
-        if self.last_rec:
-            side = self.size - 2 * self.width
-            center = self.center
-        else:
-            diag = 0.8 * (self.size - 2 * self.width)
-            side = diag / math.sqrt(2)
-            center = self.center
-            center[1] += 0.1 * side
-            self.context.translate(*center)
-            self.context.rotate(math.pi / 4)
-            self.context.translate(-center[0], -center[1])
-        points = []
-        for (i, j) in [(1, 1), (1, -1), (-1, -1), (-1, 1)]:
-            points.append((center[0] + i * side / 2, center[1] + j * side / 2))
-
-        self.last_rec = True
-        if self.last_black:
-            self.context.set_source_rgb(*WHITE)
-        else:
-            self.context.set_source_rgb(*BLACK)
-        self.last_black = not self.last_black
+        self.shape(4)
 
-        self.context.move_to(*points[0])
-        for i in points[1:]:
-            self.context.line_to(*i)
-        self.context.close_path()
-        self.context.fill()
+    def triangle(self):
+        self.shape(3)
+
+    def pentagon(self):
+        self.shape(5)
 
-        self.center = center
-        self.size = side
+    def circle(self):
+        self.shape(0)
 
     def save(self, path):
         self.surface.write_to_png(path)
@@ -165,16 +157,90 @@ def generate_2():
 #generate_0()
 #generate_1()
 
+# Digit encoded by each shape, must match `Shape` in qmix.cpp.
 mapping = {
     0: 'rectangle',
-    1: 'triangle'
+    1: 'triangle',
+    2: 'pentagon',
+    3: 'circle',
 }
-
-for i in range(7):
-    ctx = Context(512, 50)
-    n = i
-    for j in range(3):
-        action = n % 2
-        n = n // 2
+BASE = len(mapping)
+
+# Narrowest band, in pixels of the camera frame. The 15x15 Gaussian blur
+# (sigma 2.6) and threshold at 100 in camera.cpp merge bands under 4.5 px
+# with their neighbours, this leaves some margin for focus and lighting.
+MIN_BAND_PIXELS = 9
+# Smallest innermost shape, in pixels of the camera frame. Under it the blur
+# rounds corners enough for triangles and squares to pass for circles.
+MIN_SHAPE_PIXELS = 40
+# Deepest marker the decoder accepts, MAX_MARKER_DEPTH in qmix.hpp.
+MAX_DEPTH = 4
+# Band width, as a fraction of the marker size, minimizing the size the
+# marker must be seen at for every id to meet MIN_BAND_PIXELS and
+# MIN_SHAPE_PIXELS: about 170, 330 and 530 px wide.
+DEFAULT_WIDTH = {2: 0.054, 3: 0.027, 4: 0.017}
+
+
+def generate_tag(tag_id, depth, size, width, camera_size):
+    """
+    Draw the marker for `tag_id` made of `depth` nested shapes, each one
+    a digit in base `BASE`, the outermost being the least significant.
+    Must match `MarkerDecoder` in qmix.cpp.
+    Raise `ValueError` if the bands would be under MIN_BAND_PIXELS, or the
+    innermost shape under MIN_SHAPE_PIXELS, once the marker is seen
+    `camera_size` pixels wide.
+    """
+    scale = camera_size / size
+    if width * scale < MIN_BAND_PIXELS:
+        raise ValueError(
+            'Bands would be {:.1f} px wide in the camera frame, below {} px, '
+            'the marker must be seen at least {:.0f} px wide'.format(
+                width * scale, MIN_BAND_PIXELS, MIN_BAND_PIXELS * size / width))
+    ctx = Context(size, width)
+    n = tag_id
+    for j in range(depth):
+        action = n % BASE
+        n = n // BASE
         getattr(ctx, mapping[action])()
-    ctx.save('img/{}.png'.format(i))
+    if ctx.size * scale < MIN_SHAPE_PIXELS:
+        raise ValueError(
+            'Innermost shape of id {} would be {:.1f} px wide in the camera '
+            'frame, below {} px, the marker must be seen at least {:.0f} px '
+            'wide'.format(tag_id, ctx.size * scale, MIN_SHAPE_PIXELS,
+                          MIN_SHAPE_PIXELS * size / ctx.size))
+    return ctx
+
+
+if __name__ == '__main__':
+    import argparse
+    parser = argparse.ArgumentParser(description='Generate qmix markers.')
+    parser.add_argument('--depth', type=int, default=4,
+                        choices=range(2, MAX_DEPTH + 1),
+                        help='Number of nested shapes, should match '
+                             'MARKER_DEPTH in qmix.hpp.')
+    parser.add_argument('--count', type=int,
+                        help='Number of markers, default to all ids.')
+    parser.add_argument('--size', type=int, default=512)
+    parser.add_argument('--width', type=float,
+                        help='Width of the bands in pixels, default depends '
+                             'on the depth and size.')
+    parser.add_argument('--camera-size', type=float, default=540,
+                        help='Smallest width in pixels the markers will be '
+                             'seen at in the camera frames.')
+    parser.add_argument('--out', default='img')
+    args = parser.parse_args()
+
+    num_ids = BASE ** args.depth
+    count = args.count if args.count is not None else num_ids
+    if count > num_ids:
+        parser.error('Cannot generate {} markers with depth {}'.format(
+            count, args.depth))
+    width = args.width
+    if width is None:
+        width = DEFAULT_WIDTH[args.depth] * args.size
+    for i in range(count):
+        try:
+            ctx = generate_tag(i, args.depth, args.size, width, args.camera_size)
+        except ValueError as error:
+            parser.error(str(error))
+        ctx.save('{}/{}.png'.format(args.out, i))
@@ -1,8 +1,10 @@
 #include "mixer.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <chrono>
+#include <fstream>
 #include <string>
 
 #include "utils.hpp"
@@ -11,16 +13,17 @@ const int Mixer::FBP = 128;
 const int Mixer::SAMPLE_RATE = 44100;
 const int Mixer::CHANNELS = 2;
 const int Mixer::QUEUE_SIZE = 20;
-const int Mixer::NUM_SONGS = 7;
 
 const double Seeker::MAX_SPEED = 2;
 const double Seeker::SPEED_THRESHOLD = 20;
 const double Seeker::SPEED_PROBA = 0.01;
 
-const double MAX_SIZE = 0.0005;
-const double MIN_SIZE = 0.000138;
+// Marker side relative to the width of a camera, 0.0005 and 0.000138 of
+// the frame area at 640x480 before sizes were made resolution independent.
+const double MAX_SIZE = 0.24;
+const double MIN_SIZE = 0.066;
 const double MAX_SPEED = 3;
-const double KERNEL_WINDOW = 3;
+const int KERNEL_WINDOW = 3;
 
 double volume_for_size(double size) {
     size = std::max(std::min(size, MAX_SIZE), MIN_SIZE);
@@ -43,51 +46,46 @@ double get_speed(double speed_pos) {
 }
 
 inline double sinc(double x) {
-    if (x == 0) {
-        return 1;
-    } else {
-        return std::sin(M_PI * x) / (M_PI * x);
-    }
+    // Written as a select rather than a branch so loops calling it vectorize.
+    return x == 0 ? 1 : std::sin(M_PI * x) / (M_PI * x);
 }
 
 inline double lanczos(double x, double w) {
     return sinc(x) * sinc(x / w);
 }
 
-float inline interpolate(std::vector<float>& samples, double location) {
-    size_t a, size;
-    size = samples.size();
-    a = std::floor(location);
-    double result = 0;
-    for(int i=-KERNEL_WINDOW + 1; i <= KERNEL_WINDOW; ++i) {
-        double delta = location - a + i;
-        size_t idx = positive_modulo(a + i, size);
-        result += samples[idx] * lanczos(delta, KERNEL_WINDOW);
-    }
-    //return samples[a];// * (1 - w) + samples[b] * w;
-    return result;
-}
+const int KERNEL_TAPS = 2 * KERNEL_WINDOW;
+// Frames repeated around the song so that the taps never wrap.
+const int PAD_BEFORE = KERNEL_WINDOW - 1;
+const int PAD_AFTER = KERNEL_WINDOW;
 
 Seeker::Seeker(const std::string& path) : file_(path.c_str()) {
     std::vector<float> tmp;
     channels_ = file_.channels();
     sample_rate_ = file_.samplerate();
     num_samples_ = file_.frames();
-    song_.resize(channels_);
-    for (auto& c : song_) {
-        c.reserve(num_samples_);
-    }
+    std::vector<float> frames;
+    frames.reserve(num_samples_ * channels_);
     int read_size = 2048;
     tmp.resize(channels_ * read_size);
     size_t read;
     while(true) {
         read = file_.readf(tmp.data(), read_size);
         if (read == 0) break;
-        for (size_t i=0; i < read; ++i) {
-            for (int channel=0; channel < channels_; ++channel) {
-                song_[channel].push_back(tmp[i * channels_ + channel]);
-            }
-        }
+        frames.insert(frames.end(), tmp.begin(), tmp.begin() + read * channels_);
+    }
+    num_samples_ = frames.size() / channels_;
+    if (num_samples_ == 0) {
+        throw std::runtime_error("Empty song " + path);
+    }
+
+    // Interleaved, padded with the frames at the other end of the loop.
+    long padded = num_samples_ + PAD_BEFORE + PAD_AFTER;
+    song_.resize(padded * channels_);
+    for (long i=0; i < padded; ++i) {
+        long frame = positive_modulo(i - PAD_BEFORE, static_cast<long>(num_samples_));
+        std::copy_n(frames.begin() + frame * channels_, channels_,
+                    song_.begin() + i * channels_);
     }
 
     duration_ = static_cast<double>(num_samples_) / sample_rate_;
@@ -100,28 +98,86 @@ void Seeker::reset() {
     position_ = 0;
 }
 
-void Seeker::get_samples(
-        double speed,
-        std::vector<float>& buffer,
+void Seeker::mix_samples(
+        double speed_from,
+        double speed_to,
+        float volume_from,
+        float volume_to,
+        std::vector<float>& output,
         size_t n_samples) {
 
-    assert(buffer.size() == n_samples * channels_);
+    assert(output.size() == n_samples * channels_);
+    switch (channels_) {
+    case 1:
+        mix<1>(speed_from, speed_to, volume_from, volume_to, output.data(), n_samples);
+        break;
+    case 2:
+        mix<2>(speed_from, speed_to, volume_from, volume_to, output.data(), n_samples);
+        break;
+    default:
+        throw std::runtime_error(
+            "Unsupported channel count " + std::to_string(channels_));
+    }
+}
 
-    std::uniform_real_distribution<double> distro;
+template <int C>
+void Seeker::mix(
+        double speed_from,
+        double speed_to,
+        float volume_from,
+        float volume_to,
+        float* __restrict output,
+        size_t n_samples) {
 
-    auto it = buffer.begin();
+    double speed_step = (speed_to - speed_from) / n_samples;
+    float volume_step = (volume_to - volume_from) / n_samples;
+    first_.resize(n_samples);
+    offsets_.resize(n_samples);
+    weights_.resize(n_samples * KERNEL_TAPS);
 
+    // The position is a recurrence, only walk it here so that the loops
+    // below vectorize.
     for (size_t index=0; index < n_samples; ++index) {
-        for (int channel=0; channel < channels_; ++channel) {
-            //*it = song_[channel][position_];
-            *it = interpolate(song_[channel], position_);
-            //*it = song_[channel][std::floor(position_)];
-            //*it = std::sin(440 * position_ * 2 * M_PI);
-            it++;
-        }
-        position_ += speed;
+        long a = std::floor(position_);
+        first_[index] = (a - KERNEL_WINDOW + 1 + PAD_BEFORE) * C;
+        offsets_[index] = position_ - a;
+        position_ += speed_from + speed_step * index;
         position_ = positive_modulof(position_, num_samples_);
     }
+
+    // Plain pointers so that the vectorizer does not have to reload the
+    // members at every iteration. The taps are gathered, which GCC only
+    // vectorizes when it knows that the output does not alias them.
+    const long* __restrict first = first_.data();
+    const double* __restrict offsets = offsets_.data();
+    float* __restrict weights = weights_.data();
+    const float* __restrict song = song_.data();
+
+    // Lanczos weights of every frame, shared by all channels, tap major so
+    // that the loops run over contiguous frames.
+    for (int i=0; i < KERNEL_TAPS; ++i) {
+        float* tap_weights = weights + i * n_samples;
+        for (size_t index=0; index < n_samples; ++index) {
+            double delta = offsets[index] - i + KERNEL_WINDOW - 1;
+            tap_weights[index] = lanczos(delta, KERNEL_WINDOW);
+        }
+    }
+
+    // The channel count is known, so the frames are mixed a vector at a
+    // time with gathered taps.
+    for (size_t index=0; index < n_samples; ++index) {
+        float volume = volume_from + volume_step * index;
+        float frame[C] = {};
+        for (int i=0; i < KERNEL_TAPS; ++i) {
+            float weight = weights[i * n_samples + index];
+            for (int c=0; c < C; ++c) {
+                frame[c] += song[first[index] + i * C + c] * weight;
+            }
+        }
+        for (int c=0; c < C; ++c) {
+            output[index * C + c] += frame[c] * volume;
+        }
+    }
 }
 
 void Seeker::noplay(size_t n_samples) {
@@ -137,13 +193,21 @@ Mixer::Mixer()
 , from_cb_(QUEUE_SIZE)
 , from_camera_(QUEUE_SIZE) {
     dbg(lanczos(0, KERNEL_WINDOW), lanczos(-1, KERNEL_WINDOW), lanczos(-2, KERNEL_WINDOW));
-    for (int i=0; i < NUM_SONGS; ++i) {
+    // One song per marker id, as many as there are in songs/.
+    for (int i=0; i < NUM_MARKERS; ++i) {
         std::string filename = "songs/" + std::to_string(i) + ".wav";
+        if (!std::ifstream(filename)) {
+            break;
+        }
         files_.emplace_back(filename);
         assert(files_[i].file().channels() == CHANNELS);
         assert(files_[i].file().samplerate() == SAMPLE_RATE);
 
     }
+    if (files_.empty()) {
+        throw std::runtime_error("No song found in songs/");
+    }
+    dbg("Loaded songs", files_.size());
     call_pa(
         Pa_OpenDefaultStream, &stream_, 0, CHANNELS, 
         paFloat32, SAMPLE_RATE, FBP, pa_static_callback, static_cast<void*>(this));
@@ -160,12 +224,22 @@ Mixer::~Mixer() {
     call_pa(Pa_Terminate);
 }
 
+void clamp_samples(std::vector<float>& buffer) {
+    for (auto& sample : buffer) {
+        sample = std::min(1.f, std::max(-1.f, sample));
+    }
+}
+
 void Mixer::do_mixer_thread() {
     call_pa(Pa_StartStream, stream_);
-    std::vector<QRSong> state(7);
+    int num_songs = files_.size();
+    std::vector<QRSong> state;
 
-    std::vector<float> tmp_buffer;
-    tmp_buffer.resize(FBP * CHANNELS);
+    // Controls reached at the end of the last block, ramped from there
+    // to the new camera state over the next one.
+    std::vector<double> last_speed(num_songs, 1);
+    std::vector<double> last_volume(num_songs, 0);
+    std::vector<bool> last_active(num_songs, false);
     dbg("Mixer thread starting");
     while(!stop_) {
         from_camera_.read(state);
@@ -173,31 +247,42 @@ void Mixer::do_mixer_thread() {
         from_cb_.read(buffer);
         buffer.resize(FBP * CHANNELS);
         std::fill(buffer.begin(), buffer.end(), 0);
-        for (int i=0; i < NUM_SONGS; ++i) {
-            if (!state[i].active) {
+        for (int i=0; i < num_songs; ++i) {
+            bool active = i < static_cast<int>(state.size()) && state[i].active;
+            if (!active && !last_active[i]) {
                 //files_[i].reset();
                 files_[i].noplay(FBP);
                 continue;
             }
 
-            double speed_pos = state[i].center.x;
-            double speed = get_speed(speed_pos);
-            
-            files_[i].get_samples(speed, tmp_buffer, FBP);
-            double volume = volume_for_size(state[i].size);
-            for (int s=0; s < FBP; ++s) {
-                for (int c=0; c < CHANNELS; ++c) {
-                    int idx = s * CHANNELS + c;
-                    buffer[idx] += tmp_buffer[idx] * volume;
-                }
+            double speed = last_speed[i];
+            double volume = 0;
+            if (active) {
+                speed = get_speed(state[i].center.x);
+                volume = volume_for_size(state[i].size);
             }
+            if (!last_active[i]) {
+                // Fade in at the right speed rather than sweeping to it.
+                last_speed[i] = speed;
+            }
+
+            files_[i].mix_samples(
+                last_speed[i], speed, last_volume[i], volume, buffer, FBP);
+            last_speed[i] = speed;
+            last_volume[i] = volume;
+            last_active[i] = active;
         }
+        clamp_samples(buffer);
         while(to_cb_.isFull());
         to_cb_.write(std::move(buffer));
     }
     dbg("Mixer thread done");
 }
 
+int Mixer::num_songs() const {
+    return files_.size();
+}
+
 void Mixer::push_camera_state(std::vector<QRSong>&& songs) {
     if (!from_camera_.write(std::move(songs))) {
         dbg("Failed to push state from camera");
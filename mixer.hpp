@@ -18,16 +18,36 @@
 class Seeker {
 public:
     Seeker(const std::string& path);
-    void get_samples(
-        double speed,
-        std::vector<float>& buffer,
+    // Add `n_samples` interleaved frames to `output`, with speed and volume
+    // linearly ramped across the block.
+    void mix_samples(
+        double speed_from,
+        double speed_to,
+        float volume_from,
+        float volume_to,
+        std::vector<float>& output,
         size_t n_samples);
     void noplay(size_t n_samples);
     const SndfileHandle& file() const;
     void reset();
 private:
+    template <int C>
+    void mix(
+        double speed_from,
+        double speed_to,
+        float volume_from,
+        float volume_to,
+        float* __restrict output,
+        size_t n_samples);
+
     SndfileHandle file_;
-    std::vector<std::vector<float>> song_;
+    // Interleaved frames, padded for the interpolation kernel.
+    std::vector<float> song_;
+    // Per block scratch of mix, index of the first tap and offset of every
+    // frame, and kernel weights stored tap after tap.
+    std::vector<long> first_;
+    std::vector<double> offsets_;
+    std::vector<float> weights_;
     int channels_;
     int sample_rate_;
     size_t num_samples_;
@@ -49,6 +69,8 @@ public:
     Mixer();
     virtual ~Mixer();
     void push_camera_state(std::vector<QRSong>&& songs);
+    // Number of songs loaded, ids past it are ignored.
+    int num_songs() const;
 
 private:
     void do_mixer_thread();
@@ -79,7 +101,6 @@ private:
     static const int SAMPLE_RATE;
     static const int CHANNELS;
     static const int QUEUE_SIZE;
-    static const int NUM_SONGS;
 };
 
 #endif
\ No newline at end of file
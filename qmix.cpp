@@ -22,12 +22,16 @@
 
 #include <portaudio.h>
 
+#include "camera.hpp"
 #include "mixer.hpp"
 #include "utils.hpp"
 
+// The value of each shape is the digit it encodes in a marker id.
 enum class Shape {
-    TRIANGLE, 
-    SQUARE,
+    SQUARE = 0,
+    TRIANGLE = 1,
+    PENTAGON = 2,
+    CIRCLE = 3,
     OTHER
 };
 
@@ -38,68 +42,189 @@ struct ShapeInfo {
     std::vector<cv::Point> approx;
     double peri;
     double approxPeri;
+    // How well the contour matches the shape, between 0 and 1.
+    double fit {0};
 
     ShapeInfo() : shape(Shape::OTHER), center(0, 0) {}
 };
 
 const double PERI_ALLOWANCE = 0.05;
+// approxPolyDP turns a circle into a 4 or 5 sided polygon inscribed in it.
+// Call it a circle when the contour covers at least this fraction of the
+// area a circle would have over such a polygon. Blurred polygons at least
+// 40 px wide stay well below, see gentag.py.
+const double CIRCLE_AREA_FRACTION = 0.92;
+// Tolerance on the circularity 4 pi area / peri^2 of a circle.
+const double CIRCULARITY_ALLOWANCE = 0.25;
 
 ShapeInfo get_shape(const std::vector<cv::Point>& contour) {
     ShapeInfo result;
     result.peri = cv::arcLength(contour, true);
     cv::approxPolyDP(contour, result.approx, PERI_ALLOWANCE * result.peri, true);
     result.approxPeri = cv::arcLength(result.approx, true);
-    if (result.approx.size() == 3 || result.approx.size() == 4) {
-        for (const auto& i : result.approx) {
-            result.center.x += i.x;
-            result.center.y += i.y;
-        }
-        result.center.x /= result.approx.size();
-        result.center.y /= result.approx.size();
+    if (result.approx.size() < 3 || result.approx.size() > 5) {
+        return result;
+    }
+    for (const auto& i : result.approx) {
+        result.center.x += i.x;
+        result.center.y += i.y;
+    }
+    result.center.x /= result.approx.size();
+    result.center.y /= result.approx.size();
+
+    double area = cv::contourArea(contour);
+    double approx_area = cv::contourArea(result.approx);
+    double sides = result.approx.size();
+    // Area of a circle over that of a regular polygon inscribed in it.
+    double circle_ratio = M_PI / (sides / 2 * std::sin(2 * M_PI / sides));
+    if (sides > 3 && approx_area > 0 &&
+            area / approx_area > CIRCLE_AREA_FRACTION * circle_ratio) {
+        double circularity = 4 * M_PI * area / (result.peri * result.peri);
+        result.shape = Shape::CIRCLE;
+        result.size = result.peri / M_PI;
+        result.fit = 1 - std::abs(1 - circularity) / CIRCULARITY_ALLOWANCE;
+    } else {
         if (result.approx.size() == 3) {
             result.size = result.peri / 3 * std::sqrt(3) / 2;
             result.shape = Shape::TRIANGLE;
-        } else {
+        } else if (result.approx.size() == 4) {
             result.shape = Shape::SQUARE;
             result.size = result.peri / 4;
+        } else {
+            result.shape = Shape::PENTAGON;
+            result.size = result.peri / 5;
         }
+        double delta = std::abs(result.peri - result.approxPeri) / result.peri;
+        result.fit = 1 - delta / PERI_ALLOWANCE;
     }
+    result.fit = std::max(0., std::min(1., result.fit));
     return result;
 }
 
-int try_decode(const std::vector<std::vector<cv::Point>>& contours, const std::vector<cv::Vec4i>& hier, int i, ShapeInfo* info=nullptr, int level=0) {
-    auto shape = get_shape(contours[i]);
-    if (info) {
-        *info = shape;
+// Decodes nested shape markers. Each level of nesting encodes one digit in
+// base MARKER_BASE given by its Shape, the outermost shape being the least
+// significant one.
+// Shapes and partial decodes are cached per contour so that a frame costs
+// O(contours * depth) decodes and one approxPolyDP per contour at most,
+// whatever the number of markers in view. Contours whose subtree is too
+// shallow to hold the remaining levels are pruned before approximating them.
+class MarkerDecoder {
+public:
+    MarkerDecoder(
+        const std::vector<std::vector<cv::Point>>& contours,
+        const std::vector<cv::Vec4i>& hier,
+        int depth=MARKER_DEPTH);
+    int decode(int i, int level=0);
+    bool can_decode(int i, int level=0) const;
+    const ShapeInfo& shape(int i);
+
+private:
+    void compute_heights();
+
+    static const int UNKNOWN;
+
+    const std::vector<std::vector<cv::Point>>& contours_;
+    const std::vector<cv::Vec4i>& hier_;
+    int depth_;
+    std::vector<ShapeInfo> shapes_;
+    std::vector<bool> has_shape_;
+    // Number of nested levels below each contour, 0 for a leaf.
+    std::vector<int> heights_;
+    // results_[i * depth_ + level] is the decode of contour i at that level.
+    std::vector<int> results_;
+};
+
+const int MarkerDecoder::UNKNOWN = -2;
+
+MarkerDecoder::MarkerDecoder(
+        const std::vector<std::vector<cv::Point>>& contours,
+        const std::vector<cv::Vec4i>& hier,
+        int depth)
+: contours_(contours)
+, hier_(hier)
+, depth_(depth)
+, shapes_(contours.size())
+, has_shape_(contours.size(), false)
+, heights_(contours.size(), 0)
+, results_(contours.size() * depth, UNKNOWN) {
+    assert(depth > 0);
+    compute_heights();
+}
+
+void MarkerDecoder::compute_heights() {
+    // Post-order walk of the contour tree, each contour is pushed once
+    // and its children are looked at twice, so O(contours).
+    std::vector<int> stack;
+    std::vector<bool> expanded(contours_.size(), false);
+    for (size_t i = 0; i < contours_.size(); ++i) {
+        if (hier_[i][3] < 0) {
+            stack.push_back(i);
+        }
     }
-    int result = 0;
-    if (shape.shape == Shape::OTHER) {
-        return -1;
-    } else {
-        int sub_result = 0;
-        if (level < 2) {
-            sub_result = -1;
-            auto child = hier[i][2];
-            // if (hier[child][0] != -1 || hier[child][1] != -1) {
-            //     return -1;
-            // }
-            while (sub_result < 0 && child >= 0) {
-                sub_result = try_decode(contours, hier, child, nullptr, level + 1);
-                int sub_result_toplevel = try_decode(contours, hier, child, nullptr, 0);
-                if (sub_result_toplevel != -1) {
-                    return -1;
-                }
-                child = hier[child][1];
+    while (!stack.empty()) {
+        int i = stack.back();
+        if (!expanded[i]) {
+            expanded[i] = true;
+            for (int child = hier_[i][2]; child >= 0; child = hier_[child][0]) {
+                stack.push_back(child);
             }
-            if (sub_result < 0) {
-                return -1;
+            continue;
+        }
+        stack.pop_back();
+        for (int child = hier_[i][2]; child >= 0; child = hier_[child][0]) {
+            heights_[i] = std::max(heights_[i], heights_[child] + 1);
+        }
+    }
+}
+
+bool MarkerDecoder::can_decode(int i, int level) const {
+    return heights_[i] >= depth_ - 1 - level;
+}
+
+const ShapeInfo& MarkerDecoder::shape(int i) {
+    if (!has_shape_[i]) {
+        // A polygon needs at least 3 points, no need to approximate.
+        if (contours_[i].size() >= 3) {
+            shapes_[i] = get_shape(contours_[i]);
+        }
+        has_shape_[i] = true;
+    }
+    return shapes_[i];
+}
+
+int MarkerDecoder::decode(int i, int level) {
+    int& result = results_[i * depth_ + level];
+    if (result != UNKNOWN) {
+        return result;
+    }
+    result = -1;
+    // Every remaining level needs one more nested contour, prune right away
+    // when the tree is not deep enough below this one.
+    if (!can_decode(i, level)) {
+        return result;
+    }
+    const auto& info = shape(i);
+    if (info.shape == Shape::OTHER) {
+        return result;
+    }
+    int sub_result = 0;
+    if (level < depth_ - 1) {
+        sub_result = -1;
+        auto child = hier_[i][2];
+        while (sub_result < 0 && child >= 0) {
+            sub_result = decode(child, level + 1);
+            // A full marker nested inside this one means we are looking
+            // at something else.
+            if (decode(child, 0) != -1) {
+                return result;
             }
+            child = hier_[child][0];
         }
-        result = 2 * sub_result;
-        if (shape.shape == Shape::TRIANGLE) {
-            result += 1;
+        if (sub_result < 0) {
+            return result;
         }
     }
+    result = MARKER_BASE * sub_result + static_cast<int>(info.shape);
     return result;
 }
 
@@ -115,12 +240,17 @@ void find_songs(const cv::Mat& image, std::vector<QRSong>* songs, cv::Mat* outIm
 
     std::vector<std::vector<cv::Point>> tmpContours(1);
 
+    MarkerDecoder decoder(contours, hier);
     // cv::Mat drawing = cv::Mat::zeros(image.size(), CV_8UC1);
     for(size_t i = 0; i< contours.size(); i++) {
-        ShapeInfo info;
-        auto result = try_decode(contours, hier, i, &info);
-        if (info.shape == Shape::TRIANGLE || info.shape == Shape::SQUARE){
-            //double delta = std::abs(info.peri - info.approxPeri) / info.peri / PERI_ALLOWANCE;
+        if (!decoder.can_decode(i)) {
+            // Not enough nesting to be a marker, skip it before paying
+            // for the polygon approximation.
+            continue;
+        }
+        auto result = decoder.decode(i);
+        const auto& info = decoder.shape(i);
+        if (info.shape != Shape::OTHER){
             double scale = 1;
             cv::Scalar validColor(0, 255 * scale, 0, 255);
             cv::Scalar shapeColor(0, 0, 255 * scale, 255);
@@ -136,13 +266,15 @@ void find_songs(const cv::Mat& image, std::vector<QRSong>* songs, cv::Mat* outIm
             }
         }
         if (result >= 0) {
-            if (result >= songs->size()) {
+            if (result >= static_cast<int>(songs->size())) {
                 dbg("Invalid id", result);
+                continue;
             }
             QRSong song;
             song.center.x = static_cast<double>(info.center.x) / image.cols;
             song.center.y = static_cast<double>(info.center.y) / image.rows;
-            song.size = info.size / (image.cols * image.rows);
+            song.size = info.size / image.cols;
+            song.confidence = info.fit;
             song.active = true;
             (*songs)[result] = song;
         }
@@ -168,10 +300,44 @@ void make_request(const folly::dynamic& state) {
 int main(int argc, char** argv) {
     call_pa(Pa_Initialize);
     Mixer mixer;
-    cv::VideoCapture capture(0);
-    int width = capture.get(cv::CAP_PROP_FRAME_WIDTH);
-    int height = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
-    std::cout << folly::format("Camera {}x{}\n", width, height);
+
+    // Every argument is a capture source, camera index or video file,
+    // optionally followed by its placement on the surface as @x,y,w,h.
+    std::vector<std::string> args(argv + 1, argv + argc);
+    if (args.empty()) {
+        args.push_back("0");
+    }
+    std::default_random_engine engine;
+    std::uniform_int_distribution<int> distro(0, 2000000);
+    int run_id = distro(engine);
+
+    std::vector<std::unique_ptr<Camera>> cameras;
+    std::vector<cv::Rect2d> placements;
+    cv::Rect2d surface;
+    try {
+        for (size_t i=0; i < args.size(); ++i) {
+            std::string source;
+            cv::Rect2d placement;
+            parse_source(args[i], &source, &placement);
+            cameras.emplace_back(new Camera(source, i, run_id, placement));
+            placements.push_back(cameras[i]->placement());
+            surface = i == 0 ? placements[i] : (surface | placements[i]);
+        }
+    } catch (const std::runtime_error& error) {
+        // Cameras already opened are stopped by their destructor.
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    // Frames are shown side by side, scaled to the height of the first camera.
+    int height = cameras[0]->height();
+    int width = 0;
+    std::vector<int> widths;
+    for (const auto& camera : cameras) {
+        std::cout << folly::format("Camera {} {}x{}\n",
+                                   camera->index(), camera->width(), camera->height());
+        widths.push_back(camera->width() * height / camera->height());
+        width += widths.back();
+    }
 
     auto modes = sf::VideoMode::getFullscreenModes();
     for (const auto& m: modes) {
@@ -194,8 +360,10 @@ int main(int argc, char** argv) {
     std::thread show_thread([&]() {
         //auto begin = std::chrono::steady_clock::now();
         folly::dynamic state = folly::dynamic::array();
-        std::vector<bool> state_bool(7, false);
-        for (int i = 0; i < 7; ++i) {
+        // Only advertise the ids that have a song to play.
+        int num_songs = mixer.num_songs();
+        std::vector<bool> state_bool(num_songs, false);
+        for (int i = 0; i < num_songs; ++i) {
             folly::dynamic song = folly::dynamic::object;
             song["id"] = i;
             song["unlocked"] = false;
@@ -203,50 +371,57 @@ int main(int argc, char** argv) {
         }
         make_request(state);
 
-        auto begin = std::chrono::steady_clock::now();
-        auto picture_delay = std::chrono::milliseconds(200);
-        std::default_random_engine engine;
-        std::uniform_int_distribution<int> distro(0, 2000000);
-        int run_id = distro(engine);
-        int take_picture = 0;
-        int reference = 0;
+        std::vector<std::vector<QRSong>> per_camera(cameras.size());
+        std::vector<cv::Mat> drawings(cameras.size());
+        for (size_t c=0; c < cameras.size(); ++c) {
+            drawings[c] = cv::Mat::zeros(height, widths[c], CV_8UC4);
+        }
+        Detection detection;
+        std::vector<int> best_camera;
         while(!stop) {
-            cv::Mat color, gray, flipped, blurred, thresh;
-            capture >> color;
-            if (take_picture && 
-                    std::chrono::steady_clock::now() > (begin + picture_delay)) {
-                auto filename = folly::sformat("out/{}_{:01d}_{:02d}.jpg", run_id, reference, take_picture);
-                cv::imwrite(filename, color);
-                --take_picture;
-                begin += picture_delay;
+            bool updated = false;
+            for (size_t c=0; c < cameras.size(); ++c) {
+                if (!cameras[c]->read(detection)) {
+                    if (cameras[c]->done() && !per_camera[c].empty()) {
+                        // Forget what a dead camera saw last.
+                        per_camera[c].clear();
+                        drawings[c].setTo(cv::Scalar::all(0));
+                        updated = true;
+                    }
+                    continue;
+                }
+                per_camera[c] = std::move(detection.songs);
+                if (detection.drawing.size() == drawings[c].size()) {
+                    drawings[c] = std::move(detection.drawing);
+                } else {
+                    cv::resize(detection.drawing, drawings[c], drawings[c].size());
+                }
+                updated = true;
+            }
+            if (!updated) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
             }
-            cv::cvtColor(color, gray, CV_BGR2GRAY);
-            cv::flip(gray, flipped, 1);
-            cv::GaussianBlur(flipped, blurred, cv::Size(15, 15), 0);
-            cv::threshold(blurred, thresh, 100, 255, cv::THRESH_BINARY);
-            //queue.write(thresh);
-            //auto duration = std::chrono::steady_clock::now() - begin;
-            //auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
-            //std::cout << "FPS " << (i * 1000 / msec) << std::endl;
-
-            std::vector<QRSong> songs(7);
-            cv::Mat drawing;
-            find_songs(thresh, &songs, &drawing);
-            for (int i=0; i < songs.size(); ++i) {
+
+            std::vector<QRSong> songs;
+            fuse_songs(per_camera, placements, surface, &songs, &best_camera);
+            for (int i=0; i < num_songs; ++i) {
                 if (songs[i].active && !state_bool[i]) {
                     state_bool[i] = true;
                     state[i]["unlocked"] = true;
                     make_request(state);
-                    take_picture = 3;
-                    begin = std::chrono::steady_clock::now();
-                    reference = i;
+                    cameras[best_camera[i]]->take_pictures(i);
                 }
             }
             mixer.push_camera_state(std::move(songs));
-            queue.write(std::move(drawing));
-            // std::cout << songs.size() << std::endl;
+            // Only build the mosaic when the display is ready for it.
+            if (!queue.isFull()) {
+                cv::Mat mosaic;
+                cv::hconcat(drawings, mosaic);
+                queue.write(std::move(mosaic));
+            }
         }
-        dbg("Camera thread done");
+        dbg("Fusion thread done");
     });
     
     cv::Mat image, sfmlMat;
@@ -7,12 +7,39 @@
 
 #include <opencv2/core.hpp>
 
+// Number of nested shapes in a marker, each one a digit of its id in base
+// MARKER_BASE (square, triangle, pentagon, circle).
+// Every band must stay about 9 px wide in the camera frame to survive the
+// 15x15 blur in camera.cpp, and the innermost shape 40 px wide to keep its
+// corners, so deeper markers must be seen larger: about 170 px wide at
+// depth 2, 330 px at depth 3 and 530 px at depth 4, see gentag.py. 256 ids
+// thus need large markers or high resolution cameras.
+const int MARKER_BASE = 4;
+const int MAX_MARKER_DEPTH = 4;
+const int MARKER_DEPTH = 4;
+static_assert(MARKER_DEPTH >= 2 && MARKER_DEPTH <= MAX_MARKER_DEPTH,
+              "MARKER_DEPTH must be between 2 and MAX_MARKER_DEPTH");
+
+constexpr int marker_count(int depth) {
+    return depth == 0 ? 1 : MARKER_BASE * marker_count(depth - 1);
+}
+const int NUM_MARKERS = marker_count(MARKER_DEPTH);
+
 struct QRSong {
     double delay {0};
     double volume {0};
+    // Relative to the frame, until a Camera moves it to surface units.
     cv::Point2d center {0,0};
+    // Side of the marker as a fraction of the frame width, whatever the
+    // resolution and placement of the camera.
     double size {0};
+    // How well the outer shape matches, between 0 and 1.
+    double confidence {0};
     bool active {false};
 };
 
+// Decode the markers in a thresholded frame into `songs`, indexed by marker
+// id, and draw the detected shapes to `outImage`.
+void find_songs(const cv::Mat& image, std::vector<QRSong>* songs, cv::Mat* outImage);
+
 #endif
\ No newline at end of file